@@ -0,0 +1,54 @@
+#include "huffman.h"
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+
+using namespace huffman_algo;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: huffman_archiver_bench %filename%\n";
+        return -1;
+    }
+    const double mb = 1 << 20;
+    std::cout << "level\tratio\tcompress MB/s\tuncompress MB/s" << std::endl;
+    try {
+        for (int level = huffman_archiver::min_level;
+             level <= huffman_archiver::max_level; ++level) {
+            auto start = std::chrono::steady_clock::now();
+            huffman_archiver* arch =
+                new huffman_archiver(argv[1], "bench_archive");
+            arch->set_level(level);
+            arch->archive();
+            size_t source_len = arch->get_source_data_size();
+            size_t archive_len =
+                arch->get_received_data_size() + arch->get_extra_data_size();
+            delete arch;
+            double archive_time = seconds_since(start);
+
+            start = std::chrono::steady_clock::now();
+            huffman_archiver* unarch =
+                new huffman_archiver("bench_archive", "bench_unarchive");
+            unarch->unarchive();
+            delete unarch;
+            double unarchive_time = seconds_since(start);
+
+            std::cout << std::fixed << std::setprecision(3)
+                      << level << "\t"
+                      << (double)archive_len / std::max(source_len, (size_t)1)
+                      << "\t" << source_len / mb / archive_time
+                      << "\t" << source_len / mb / unarchive_time << std::endl;
+        }
+    } catch (archive_exception& e) {
+        std::cerr << e << std::endl;
+        return -1;
+    }
+    std::remove("bench_archive");
+    std::remove("bench_unarchive");
+    return 0;
+}
@@ -70,7 +70,7 @@ namespace huffman_algo {
         }
     }
 
-    huff_tree::huff_tree(std::map<char, int>& freqs) {
+    huff_tree::huff_tree(std::map<char, int>& freqs, size_t max_len) {
         auto compare_nodes = [](tree_node* lhs, tree_node* rhs) {
                 return (lhs->get_frequence() > rhs->get_frequence());
             }; 
@@ -122,6 +122,8 @@ namespace huffman_algo {
             }
             throw archive_exception("Error: no free memory.");
         }
+        if (max_len != 0 && get_max_code_length() > max_len)
+            limit_code_lengths(freqs, max_len);
     }
 
     tree_node* huff_tree::get_root() const {
@@ -132,6 +134,64 @@ namespace huffman_algo {
         return codes_[c];
     }
 
+    void huff_tree::set_escape(char c) {
+        has_escape_ = true;
+        escape_ = c;
+    }
+
+    bool huff_tree::has_escape() const {
+        return has_escape_;
+    }
+
+    char huff_tree::get_escape() const {
+        return escape_;
+    }
+
+    void huff_tree::encode_char(bit_ref_writer& brw, char c) {
+        bool known = code_lens_[(unsigned char)c] != 0;
+        if (has_escape_ && (!known || c == escape_)) {
+            put_code(brw, escape_);
+            brw.write_char(c);
+            return;
+        }
+        if (!known) {
+            throw archive_exception("Error: letter has no code");
+        }
+        put_code(brw, c);
+    }
+
+    void huff_tree::put_code(bit_ref_writer& brw, char c) {
+        size_t len = code_lens_[(unsigned char)c];
+        if (len <= bit_ref_writer::max_bits) {
+            brw.add_bits(code_bits_[(unsigned char)c], len);
+            return;
+        }
+        for (auto b : codes_[c]) {
+            brw.add_bit(b);
+        }
+    }
+
+    size_t huff_tree::get_encoded_size(const histogram& h) const {
+        size_t bits = 0;
+        for (size_t c = 0; c < h.size(); ++c) {
+            if (h[c] == 0)
+                continue;
+            size_t len = code_lens_[c];
+            if (has_escape_ && (len == 0 || (char)c == escape_)) {
+                len = code_lens_[(unsigned char)escape_] + CHAR_BIT;
+            } else if (len == 0) {
+                return SIZE_MAX;
+            }
+            bits += h[c] * len;
+        }
+        return bits;
+    }
+
+    size_t huff_tree::get_table_size() const {
+        return block_splitter::table_cost(codes_.size()) +
+            (has_escape_ ? CHAR_BIT : 0);
+    }
+
     char huff_tree::deserialize_char(bit_ref_reader& brr) {
         tree_node* find_node = get_root();
         while (!(
@@ -150,15 +210,126 @@ namespace huffman_algo {
                 find_node = find_node->get_left_node();
             }
         }
+        if (has_escape_ && find_node->get_letter() == escape_)
+            return brr.read_char();
         return find_node->get_letter();
     }
 
+    void huff_tree::limit_code_lengths(
+        std::map<char, int>& freqs,
+        size_t max_len
+    ){
+        // Package-merge: the cheapest 2n - 2 items of the last list give
+        // optimal code lengths bounded by max_len.
+        struct pm_item {
+            uint64_t weight;
+            int leaf;
+            size_t first;
+        };
+        std::vector<std::pair<int, char>> leaves;
+        for (auto &it : freqs) {
+            leaves.push_back(std::make_pair(it.second, it.first));
+        }
+        std::sort(leaves.begin(), leaves.end());
+        size_t n = leaves.size();
+        if (n > ((size_t)1 << max_len)) {
+            throw archive_exception("Error: code length limit is too small");
+        }
+
+        std::vector<pm_item> leaf_items;
+        for (size_t i = 0; i < n; ++i) {
+            leaf_items.push_back(pm_item{(uint64_t)leaves[i].first, (int)i, 0});
+        }
+        std::vector<std::vector<pm_item>> lists(1, leaf_items);
+        for (size_t l = 1; l < max_len; ++l) {
+            const std::vector<pm_item>& prev = lists.back();
+            std::vector<pm_item> merged;
+            size_t li = 0;
+            size_t pi = 0;
+            while (li < n || pi + 1 < prev.size()) {
+                bool take_leaf = pi + 1 >= prev.size() || (li < n &&
+                    leaf_items[li].weight <=
+                    prev[pi].weight + prev[pi + 1].weight);
+                if (take_leaf) {
+                    merged.push_back(leaf_items[li++]);
+                } else {
+                    merged.push_back(pm_item{
+                        prev[pi].weight + prev[pi + 1].weight, -1, pi});
+                    pi += 2;
+                }
+            }
+            lists.push_back(merged);
+        }
+
+        std::vector<size_t> lens(n, 0);
+        std::vector<std::pair<size_t, size_t>> stack;
+        for (size_t i = 0; i < 2 * n - 2; ++i) {
+            stack.push_back(std::make_pair(lists.size() - 1, i));
+        }
+        while (!stack.empty()) {
+            const pm_item& item = lists[stack.back().first][stack.back().second];
+            size_t l = stack.back().first;
+            stack.pop_back();
+            if (item.leaf >= 0) {
+                ++lens[item.leaf];
+            } else {
+                stack.push_back(std::make_pair(l - 1, item.first));
+                stack.push_back(std::make_pair(l - 1, item.first + 1));
+            }
+        }
+
+        // Rebuild the tree from canonical codes of the new lengths.
+        std::vector<std::pair<size_t, size_t>> order;
+        for (size_t i = 0; i < n; ++i) {
+            order.push_back(std::make_pair(lens[i], i));
+        }
+        std::sort(order.begin(), order.end());
+        std::unique_ptr<tree_node> root(new tree_node(nullptr, nullptr));
+        uint64_t code = 0;
+        size_t prev_len = order[0].first;
+        for (auto &it : order) {
+            size_t len = it.first;
+            code <<= len - prev_len;
+            prev_len = len;
+            tree_node* nd = root.get();
+            for (size_t d = 0; d < len; ++d) {
+                bool bit = (code >> (len - 1 - d)) & 1;
+                tree_node* next =
+                    bit ? nd->get_right_node() : nd->get_left_node();
+                if (next == nullptr) {
+                    if (d + 1 == len) {
+                        next = new tree_node(
+                            leaves[it.second].second, leaves[it.second].first);
+                    } else {
+                        next = new tree_node(nullptr, nullptr);
+                    }
+                    if (bit)
+                        nd->set_right_node(next);
+                    else
+                        nd->set_left_node(next);
+                }
+                nd = next;
+            }
+            ++code;
+        }
+        tree_root_ = std::move(root);
+        codes_.clear();
+        code_lens_ = std::array<size_t, 1 << CHAR_BIT>();
+        std::vector<bool> v(0);
+        process_codes(v, tree_root_.get());
+    }
+
     void huff_tree::process_codes(std::vector<bool>& v, tree_node* nd) {
         if (nd == nullptr)
             return;
 
         if (nd->get_left_node() == nullptr && nd->get_right_node() == nullptr) {
             codes_[nd->get_letter()] = v;
+            uint64_t bits = 0;
+            for (size_t i = 0; i < v.size() && i < bit_ref_writer::max_bits; ++i)
+                bits = bits << 1 | v[i];
+            code_bits_[(unsigned char)nd->get_letter()] = bits;
+            code_lens_[(unsigned char)nd->get_letter()] = v.size();
             return;
         }
         if (nd->get_left_node() != nullptr) {
@@ -174,6 +345,352 @@ namespace huffman_algo {
         }
     }
 
+    size_t huff_tree::get_min_code_length() const {
+        return code_length(get_root(), false);
+    }
+
+    size_t huff_tree::get_max_code_length() const {
+        return code_length(get_root(), true);
+    }
+
+    size_t huff_tree::code_length(const tree_node* nd, bool longest) {
+        const tree_node* l = nd->get_left_node();
+        const tree_node* r = nd->get_right_node();
+        if (l == nullptr && r == nullptr)
+            return 0;
+        if (l == nullptr)
+            return code_length(r, longest) + 1;
+        if (r == nullptr)
+            return code_length(l, longest) + 1;
+        size_t l_len = code_length(l, longest);
+        size_t r_len = code_length(r, longest);
+        return (longest ? std::max(l_len, r_len) : std::min(l_len, r_len)) + 1;
+    }
+
+    void tree_decoder::decode(bit_ref_reader& brr, char* out, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            out[i] = tree_.deserialize_char(brr);
+        }
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    table_decoder<TableBits, MaxCodeLen, MaxSymbols>::table_decoder(
+        const huff_tree& tree
+    ) : table_(1 << TableBits),
+        has_escape_(tree.has_escape()),
+        escape_(tree.get_escape()) {
+        fill_entries(tree.get_root(), 0, 0);
+        if (MaxSymbols == 1)
+            return;
+
+        // Append the letters whose codes fit into the rest of the window:
+        // the single-letter entry of the remaining bits already knows them.
+        const size_t mask = table_.size() - 1;
+        std::vector<table_entry> single = table_;
+        for (size_t p = 0; p < table_.size(); ++p) {
+            table_entry& e = table_[p];
+            if (e.count == 0)
+                continue;
+            while (e.count < MaxSymbols) {
+                const table_entry& next = single[(p << e.bits) & mask];
+                if (next.count == 0 || next.first_bits > TableBits - e.bits)
+                    break;
+                e.letters[e.count++] = next.letters[0];
+                e.bits += next.first_bits;
+            }
+        }
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    void table_decoder<TableBits, MaxCodeLen, MaxSymbols>::fill_entries(
+        const tree_node* nd,
+        size_t code,
+        size_t depth
+    ) {
+        // A leaf at depth len owns every window starting with its code;
+        // entries no code reaches stay empty and are rejected on decode.
+        if (nd == nullptr)
+            return;
+        if (nd->get_left_node() == nullptr && nd->get_right_node() == nullptr) {
+            if (depth == 0)
+                return;
+            table_entry e = table_entry();
+            if (has_escape_ && nd->get_letter() == escape_) {
+                e.escape = true;
+            } else {
+                e.letters[0] = nd->get_letter();
+                e.count = 1;
+            }
+            e.bits = depth;
+            e.first_bits = depth;
+            size_t shift = TableBits - depth;
+            std::fill(
+                table_.begin() + (code << shift),
+                table_.begin() + ((code + 1) << shift),
+                e);
+            return;
+        }
+        // A code longer than the window is finished by walking the tree
+        // from the node the window ends in.
+        if (depth == TableBits) {
+            table_entry e = table_entry();
+            e.node = nd;
+            e.bits = TableBits;
+            table_[code] = e;
+            return;
+        }
+        fill_entries(nd->get_left_node(), code << 1, depth + 1);
+        fill_entries(nd->get_right_node(), code << 1 | 1, depth + 1);
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    const typename table_decoder<TableBits, MaxCodeLen, MaxSymbols>::table_entry&
+    table_decoder<TableBits, MaxCodeLen, MaxSymbols>::lookup(
+        bit_ref_reader& brr
+    ) const {
+        return table_[brr.peek_bits(TableBits)];
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    char table_decoder<TableBits, MaxCodeLen, MaxSymbols>::decode_long(
+        bit_ref_reader& brr,
+        const table_entry& e
+    ) const {
+        if (e.escape) {
+            brr.skip_bits(e.first_bits);
+            return read_escaped(brr);
+        }
+        if (MaxCodeLen <= TableBits || e.node == nullptr) {
+            throw archive_exception("Error: input file is wrong");
+        }
+        // Long codes are rare: topping the buffer up here lets the batch be
+        // sized by the window alone.
+        brr.skip_bits(TableBits);
+        brr.refill();
+        const tree_node* nd = e.node;
+        while (!(nd->get_left_node() == nullptr &&
+                 nd->get_right_node() == nullptr)) {
+            bool b = brr.peek_bits(1);
+            brr.skip_bits(1);
+            nd = b ? nd->get_right_node() : nd->get_left_node();
+            if (nd == nullptr) {
+                throw archive_exception("Error: input file is wrong");
+            }
+        }
+        if (has_escape_ && nd->get_letter() == escape_)
+            return read_escaped(brr);
+        return nd->get_letter();
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    char table_decoder<TableBits, MaxCodeLen, MaxSymbols>::read_escaped(
+        bit_ref_reader& brr
+    ) const {
+        // The raw letter isn't covered by the per-refill bit budget, so the
+        // buffer is topped up again for the remaining lookups.
+        char c = brr.read_char();
+        brr.refill();
+        return c;
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    void table_decoder<TableBits, MaxCodeLen, MaxSymbols>::decode(
+        bit_ref_reader& brr,
+        char* out,
+        size_t len
+    ) {
+        // One refill always covers lookups_per_refill lookups, which are
+        // unrolled at compile time without any buffer checks.
+        size_t i = 0;
+        while (len - i >= lookups_per_refill * MaxSymbols) {
+            brr.refill();
+            decode_lookups(
+                brr, out, i,
+                std::integral_constant<size_t, lookups_per_refill>());
+        }
+        while (i < len) {
+            brr.refill();
+            const table_entry& e = lookup(brr);
+            if (e.count == 0) {
+                out[i++] = decode_long(brr, e);
+                continue;
+            }
+            out[i++] = e.letters[0];
+            brr.skip_bits(e.first_bits);
+        }
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    template <size_t K>
+    void table_decoder<TableBits, MaxCodeLen, MaxSymbols>::decode_lookups(
+        bit_ref_reader& brr,
+        char* out,
+        size_t& i,
+        std::integral_constant<size_t, K>
+    ) const {
+        decode_lookup(brr, out, i);
+        decode_lookups(brr, out, i, std::integral_constant<size_t, K - 1>());
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    void table_decoder<TableBits, MaxCodeLen, MaxSymbols>::decode_lookups(
+        bit_ref_reader&,
+        char*,
+        size_t&,
+        std::integral_constant<size_t, 0>
+    ) const {
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    void table_decoder<TableBits, MaxCodeLen, MaxSymbols>::decode_lookup(
+        bit_ref_reader& brr,
+        char* out,
+        size_t& i
+    ) const {
+        const table_entry& e = lookup(brr);
+        if (e.count == 0) {
+            out[i++] = decode_long(brr, e);
+            return;
+        }
+        std::memcpy(out + i, e.letters, MaxSymbols);
+        i += e.count;
+        brr.skip_bits(e.bits);
+    }
+
+    template <size_t TableBits, size_t MaxCodeLen>
+    std::unique_ptr<block_decoder> block_decoder::create_table(
+        const huff_tree& tree
+    ) {
+        // Several symbols fit into one lookup only if the most frequent
+        // code takes at most half of the window.
+        if (tree.get_min_code_length() * 2 <= TableBits) {
+            return std::unique_ptr<block_decoder>(
+                new table_decoder<TableBits, MaxCodeLen, 4>(tree));
+        }
+        return std::unique_ptr<block_decoder>(
+            new table_decoder<TableBits, MaxCodeLen, 1>(tree));
+    }
+
+    std::unique_ptr<block_decoder> block_decoder::create(huff_tree& tree) {
+        size_t max_len = tree.get_max_code_length();
+        if (max_len == 0 || max_len > 32)
+            return std::unique_ptr<block_decoder>(new tree_decoder(tree));
+        if (max_len <= 8)
+            return create_table<8, 8>(tree);
+        if (max_len <= 10)
+            return create_table<10, 10>(tree);
+        if (max_len <= 12)
+            return create_table<12, 12>(tree);
+        return create_table<12, 32>(tree);
+    }
+
+    void block_splitter::add_char(char c) {
+        ++segment_[(unsigned char)c];
+        if (++segment_len_ == segment_size_)
+            close_segment();
+    }
+
+    void block_splitter::finish() {
+        close_segment();
+        close_block();
+    }
+
+    const std::vector<size_t>& block_splitter::get_block_lengths() const {
+        return lengths_;
+    }
+
+    const std::vector<histogram>& block_splitter::get_block_histograms() const {
+        return hists_;
+    }
+
+    size_t block_splitter::estimate_cost(const histogram& h) {
+        size_t symbols = 0;
+        for (auto n : h) {
+            symbols += (n != 0);
+        }
+        if (symbols == 0)
+            return 0;
+        return data_cost(h) + table_cost(symbols);
+    }
+
+    size_t block_splitter::data_cost(const histogram& h) {
+        size_t total = 0;
+        for (auto n : h) {
+            total += n;
+        }
+        double bits = 0;
+        for (auto n : h) {
+            if (n != 0)
+                bits += n * std::log2((double)total / n);
+        }
+        // Every huffman code is at least one bit long.
+        return std::max((size_t)std::ceil(bits), total);
+    }
+
+    bool block_splitter::beats_fresh_table(
+        size_t reuse_size,
+        const histogram& h,
+        size_t scale
+    ){
+        // No fresh table beats the entropy bound, so a previous table that
+        // does can be kept without building a new tree.
+        if (reuse_size == SIZE_MAX)
+            return false;
+        size_t symbols = 0;
+        for (auto n : h) {
+            symbols += (n != 0);
+        }
+        return reuse_size * scale <= data_cost(h) * scale + table_cost(symbols);
+    }
+
+    size_t block_splitter::table_cost(size_t symbols) {
+        // Two child flags for every node and a letter for every non-root one.
+        if (symbols == 0)
+            return 2;
+        if (symbols == 1)
+            return 2 * 2 + CHAR_BIT;
+        return 2 * (2 * symbols - 1) + CHAR_BIT * (2 * symbols - 2);
+    }
+
+    void block_splitter::close_segment() {
+        if (segment_len_ == 0)
+            return;
+        if (block_len_ + segment_len_ > max_block_len)
+            close_block();
+
+        if (!adaptive_ || block_len_ == 0) {
+            for (size_t c = 0; c < block_.size(); ++c)
+                block_[c] += segment_[c];
+            block_cost_ = adaptive_ ? estimate_cost(block_) : 0;
+        } else {
+            histogram merged = block_;
+            for (size_t c = 0; c < merged.size(); ++c)
+                merged[c] += segment_[c];
+            size_t merged_cost = estimate_cost(merged);
+            size_t segment_cost = estimate_cost(segment_);
+            if (block_cost_ + segment_cost < merged_cost) {
+                close_block();
+                block_ = segment_;
+                block_cost_ = segment_cost;
+            } else {
+                block_ = merged;
+                block_cost_ = merged_cost;
+            }
+        }
+        block_len_ += segment_len_;
+        segment_ = histogram();
+        segment_len_ = 0;
+    }
+
+    void block_splitter::close_block() {
+        if (block_len_ == 0)
+            return;
+        lengths_.push_back(block_len_);
+        hists_.push_back(block_);
+        block_ = histogram();
+        block_len_ = 0;
+        block_cost_ = 0;
+    }
 
     huffman_archiver::huffman_archiver(
         const std::string& in_fn,
@@ -216,52 +733,233 @@ namespace huffman_algo {
         outp.close();
     }
 
+    // Finer segments of levels 7-9 give more fresh tables, which costs
+    // compression speed; uncompressing stays on par with levels 4-6, and
+    // their length limit only applies where it keeps the ratio.
+    const huffman_archiver::level_params huffman_archiver::levels_[] = {
+        {16, 1 << 16, 0},
+        {8, 1 << 16, 0},
+        {4, 1 << 16, 0},
+        {0, 1 << 16, 0},
+        {0, 1 << 15, 0},
+        {0, 1 << 14, 0},
+        {0, 1 << 13, 15},
+        {0, 1 << 12, 15},
+        {0, 1 << 11, 15}
+    };
+
     void huffman_archiver::archive() {
-        std::map<char, int> freqs;
+        const level_params& lp = levels_[level_ - min_level];
+        char level = level_;
+        outp.write((char*)&source_len_, sizeof(size_t));
+        outp.write(&level, sizeof(char));
+        bit_ref_writer brw(outp);
 
-        std::istream_iterator<char> end_;
-        for (std::istream_iterator<char> beg_(inp); beg_ != end_; ++beg_) {
-            ++freqs[*beg_];
-            ++source_len_;
-        }
-        huff_tree huff_tree_(freqs);
+        size_t header_bits = lp.sample_stride != 0 ?
+            archive_sampled(brw, lp) : archive_counted(brw, lp);
 
+        extra_len_ = (header_bits + CHAR_BIT - 1) / CHAR_BIT +
+            sizeof(size_t) + sizeof(char);
+        received_len_ =
+            (brw.get_total_bits() - header_bits + CHAR_BIT - 1) / CHAR_BIT;
+        if (brw.get_pos() != 0) {
+            for (size_t i = brw.get_pos(); i < CHAR_BIT; ++i) {
+                brw.add_bit(1);
+            }
+        }
+        // The sampled levels learn the length only after the single pass.
+        outp.seekp(0, outp.beg);
         outp.write((char*)&source_len_, sizeof(size_t));
-        bit_ref_writer brw(outp);
-        huff_tree_.get_root()->serialize(brw);
-        extra_len_ = brw.get_counter() + sizeof(size_t);
+    }
+
+    size_t huffman_archiver::archive_sampled(
+        bit_ref_writer& brw,
+        const level_params& lp
+    ){
+        std::unique_ptr<huff_tree> huff_tree_;
+        std::vector<char> data(lp.segment_len);
+        size_t header_bits = 0;
+        for (;;) {
+            inp.read(data.data(), data.size());
+            size_t len = inp.gcount();
+            if (len == 0)
+                break;
+            source_len_ += len;
+            // Sampling short runs rather than single bytes keeps periodic
+            // data from aliasing with the stride.
+            histogram sample = histogram();
+            for (size_t i = 0; i < len; i += sample_run * lp.sample_stride) {
+                for (size_t j = i; j < std::min(i + sample_run, len); ++j)
+                    ++sample[(unsigned char)data[j]];
+            }
+            header_bits +=
+                write_block(brw, huff_tree_, sample, data.data(), len, lp);
+        }
+        return header_bits;
+    }
+
+    size_t huffman_archiver::archive_counted(
+        bit_ref_writer& brw,
+        const level_params& lp
+    ){
+        block_splitter splitter(adaptive_blocks_, lp.segment_len);
+        std::vector<char> data(lp.segment_len);
+        for (;;) {
+            inp.read(data.data(), data.size());
+            size_t len = inp.gcount();
+            if (len == 0)
+                break;
+            for (size_t i = 0; i < len; ++i) {
+                splitter.add_char(data[i]);
+            }
+            source_len_ += len;
+        }
+        splitter.finish();
 
         inp.clear();
         inp.seekg(0, inp.beg);
-        brw.clear_counter();
-        for (std::istream_iterator<char> beg_(inp); beg_ != end_; ++beg_) {
-           for (auto c : huff_tree_.get_code(*beg_)) {
-               brw.add_bit(c);
-           }
+        std::unique_ptr<huff_tree> huff_tree_;
+        size_t header_bits = 0;
+        const std::vector<size_t>& lengths = splitter.get_block_lengths();
+        const std::vector<histogram>& hists = splitter.get_block_histograms();
+        for (size_t i = 0; i < lengths.size(); ++i) {
+            data.resize(lengths[i]);
+            inp.read(data.data(), lengths[i]);
+            header_bits += write_block(
+                brw, huff_tree_, hists[i], data.data(), lengths[i], lp);
         }
-        if (brw.get_pos() != 0) {
-            for (size_t i = brw.get_pos(); i < CHAR_BIT; ++i) {
-                brw.add_bit(1);
+        return header_bits;
+    }
+
+    size_t huffman_archiver::write_block(
+        bit_ref_writer& brw,
+        std::unique_ptr<huff_tree>& tree,
+        const histogram& hist,
+        const char* data,
+        size_t len,
+        const level_params& lp
+    ){
+        size_t scale = std::max(lp.sample_stride, (size_t)1);
+        size_t reuse_size =
+            tree != nullptr ? tree->get_encoded_size(hist) : SIZE_MAX;
+        std::map<char, int> freqs;
+        for (size_t c = 0; c < hist.size(); ++c) {
+            if (hist[c] != 0)
+                freqs[(char)c] = hist[c];
+        }
+        bool reuse = block_splitter::beats_fresh_table(reuse_size, hist, scale);
+
+        std::unique_ptr<huff_tree> fresh;
+        if (!reuse) {
+            // A sampled histogram may miss letters of the block: those are
+            // sent raw after the code of a letter the sample hasn't seen.
+            bool escape = false;
+            char escape_letter = 0;
+            for (size_t c = 0; lp.sample_stride != 0 && c < hist.size(); ++c) {
+                if (hist[c] == 0) {
+                    escape = true;
+                    escape_letter = c;
+                    freqs[escape_letter] = 1;
+                    break;
+                }
             }
+            fresh.reset(new huff_tree(freqs));
+            if (lp.max_code_len != 0 &&
+                fresh->get_max_code_length() > lp.max_code_len) {
+                // Length-limited codes are kept only when they cost no ratio,
+                // so that higher levels never compress worse than lower ones.
+                std::unique_ptr<huff_tree> limited(
+                    new huff_tree(freqs, lp.max_code_len));
+                if (limited->get_encoded_size(hist) <=
+                    fresh->get_encoded_size(hist)) {
+                    fresh = std::move(limited);
+                }
+            }
+            if (escape)
+                fresh->set_escape(escape_letter);
+            reuse = reuse_size != SIZE_MAX && reuse_size * scale <=
+                fresh->get_encoded_size(hist) * scale + fresh->get_table_size();
+        }
+
+        size_t header_start = brw.get_total_bits();
+        brw.add_bit(!reuse);
+        brw.write_size(len);
+        if (!reuse) {
+            tree = std::move(fresh);
+            tree->get_root()->serialize(brw);
+            brw.add_bit(tree->has_escape());
+            if (tree->has_escape())
+                brw.write_char(tree->get_escape());
         }
-        received_len_ = brw.get_counter();
+        size_t header_bits = brw.get_total_bits() - header_start;
+
+        for (size_t i = 0; i < len; ++i) {
+            tree->encode_char(brw, data[i]);
+        }
+        return header_bits;
     }
 
     void huffman_archiver::unarchive() {
         inp.read((char*)&received_len_, sizeof(size_t));
+        char level = 0;
+        inp.read(&level, sizeof(char));
+        if (level < min_level || level > max_level) {
+            throw archive_exception("Error: input file is wrong");
+        }
+        level_ = level;
 
         bit_ref_reader brr(inp);
 
-        huff_tree huff_tree_;
-        huff_tree_.get_root()->deserialize(brr);
-        extra_len_ = brr.get_byte_counter() + sizeof(size_t);
-        
-        brr.clear_counter();
-        for (size_t i = 0; i < received_len_; ++i) {
-            char letter = huff_tree_.deserialize_char(brr);
-            outp.write((char*)&letter, sizeof(char));
+        std::unique_ptr<huff_tree> huff_tree_;
+        std::unique_ptr<block_decoder> decoder;
+        std::vector<char> buf(1 << 16);
+        size_t header_bits = 0;
+        size_t decoded = 0;
+        while (decoded < received_len_) {
+            size_t header_start = brr.get_total_bits();
+            bool fresh = brr.get_bit();
+            size_t block_len = brr.read_size();
+            if (block_len == 0 || block_len > received_len_ - decoded) {
+                throw archive_exception("Error: input file is wrong");
+            }
+            if (fresh) {
+                decoder.reset();
+                huff_tree_.reset(new huff_tree());
+                huff_tree_->get_root()->deserialize(brr);
+                if (brr.get_bit())
+                    huff_tree_->set_escape(brr.read_char());
+                decoder = block_decoder::create(*huff_tree_);
+            } else if (huff_tree_ == nullptr) {
+                throw archive_exception("Error: input file is wrong");
+            }
+            header_bits += brr.get_total_bits() - header_start;
+
+            for (size_t i = 0; i < block_len; i += buf.size()) {
+                size_t n = std::min(block_len - i, buf.size());
+                decoder->decode(brr, buf.data(), n);
+                outp.write(buf.data(), n);
+            }
+            decoded += block_len;
+        }
+        extra_len_ = (header_bits + CHAR_BIT - 1) / CHAR_BIT +
+            sizeof(size_t) + sizeof(char);
+        source_len_ =
+            (brr.get_total_bits() - header_bits + CHAR_BIT - 1) / CHAR_BIT;
+    }
+
+    void huffman_archiver::set_adaptive_blocks(bool adaptive) {
+        adaptive_blocks_ = adaptive;
+    }
+
+    void huffman_archiver::set_level(int level) {
+        if (level < min_level || level > max_level) {
+            throw archive_exception("Error: invalid compression level.");
         }
-        source_len_ = brr.get_counter();
+        level_ = level;
+    }
+
+    int huffman_archiver::get_level() const {
+        return level_;
     }
 
     size_t huffman_archiver::get_source_data_size() const {
@@ -277,28 +975,76 @@ namespace huffman_algo {
     }
 
     bool bit_ref_reader::get_bit() {
-        pos_ %= 8;
-        if (pos_ == 0) {
-            char c = 0;
-            rs_.read((char*)&c, sizeof(char));
-            bs_ = std::bitset<CHAR_BIT>(c);
-        }
-        ++bit_cnt_;
-        if (bit_cnt_ == CHAR_BIT) {
-            ++byte_cnt_;
-            bit_cnt_ = 0;
-        }
-        return bs_[CHAR_BIT - 1 - (pos_++)];
+        if (buf_len_ == 0)
+            refill();
+        bool b = peek_bits(1);
+        skip_bits(1);
+        return b;
     }
 
     char bit_ref_reader::read_char() {
-        char c = 0;
-        for (size_t i = 0; i < CHAR_BIT; ++i) {
-            c |= get_bit() << (CHAR_BIT - 1 - i);
-        }
+        if (buf_len_ < CHAR_BIT)
+            refill();
+        char c = peek_bits(CHAR_BIT);
+        skip_bits(CHAR_BIT);
         return c;
     }
 
+    void bit_ref_reader::refill() {
+        // Tops the buffer up to at least refill_bits bits with one
+        // unaligned big-endian load; bytes past the end of file read as 0.
+        if (chunk_pos_ + 8 > chunk_end_)
+            read_chunk();
+        const unsigned char* p = chunk_.data() + chunk_pos_;
+        uint64_t v =
+            (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 |
+            (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32 |
+            (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+            (uint64_t)p[6] << 8 | (uint64_t)p[7];
+        buf_ |= v >> buf_len_;
+        chunk_pos_ += (63 - buf_len_) >> 3;
+        buf_len_ |= refill_bits;
+    }
+
+    uint64_t bit_ref_reader::peek_bits(size_t n) const {
+        return buf_ >> (64 - n);
+    }
+
+    void bit_ref_reader::skip_bits(size_t n) {
+        buf_ <<= n;
+        buf_len_ -= n;
+        bit_cnt_ += n;
+        byte_cnt_ += bit_cnt_ / CHAR_BIT;
+        bit_cnt_ %= CHAR_BIT;
+        pos_ = (pos_ + n) % CHAR_BIT;
+    }
+
+    void bit_ref_reader::read_chunk() {
+        size_t left = chunk_pos_ < chunk_end_ ? chunk_end_ - chunk_pos_ : 0;
+        std::copy(
+            chunk_.begin() + chunk_pos_,
+            chunk_.begin() + chunk_pos_ + left,
+            chunk_.begin());
+        chunk_pos_ = 0;
+        chunk_end_ = left;
+        rs_.read((char*)chunk_.data() + left, chunk_len);
+        chunk_end_ += rs_.gcount();
+        std::fill(chunk_.begin() + chunk_end_, chunk_.end(), 0);
+        if (chunk_end_ < 8)
+            chunk_end_ = 8;
+    }
+
+    size_t bit_ref_reader::read_size() {
+        size_t n = 0;
+        for (size_t shift = 0; shift < sizeof(size_t) * CHAR_BIT; shift += 7) {
+            unsigned char c = read_char();
+            n |= (size_t)(c & 0x7f) << shift;
+            if ((c & 0x80) == 0)
+                return n;
+        }
+        throw archive_exception("Error: input file is wrong");
+    }
+
     size_t bit_ref_reader::get_counter() const {
         return byte_cnt_ + 
         (bit_cnt_ + (CHAR_BIT - pos_) % CHAR_BIT + CHAR_BIT - 1) / CHAR_BIT;
@@ -313,18 +1059,37 @@ namespace huffman_algo {
         return bit_cnt_;
     }
 
+    size_t bit_ref_reader::get_total_bits() const {
+        return byte_cnt_ * CHAR_BIT + bit_cnt_;
+    }
+
     size_t bit_ref_reader::get_byte_counter() const {
         return byte_cnt_ + (bit_cnt_ + CHAR_BIT - 1) / CHAR_BIT;
     }
 
     void bit_ref_writer::add_bit(bool b) {
-        bs_ |= b << (CHAR_BIT - pos_ - 1);
-        ++bit_cnt_;
-        ++pos_;
-        if (pos_ == CHAR_BIT) {
-            pos_ = 0;
-            ws_.write((char*)&bs_, sizeof(char));
-            bs_ = 0;
+        add_bits(b, 1);
+    }
+
+    void bit_ref_writer::add_bits(uint64_t bits, size_t n) {
+        // Whole bytes are written out at once, so at most CHAR_BIT - 1
+        // bits stay in acc_ between calls.
+        if (n == 0)
+            return;
+        acc_ |= bits << (64 - pos_ - n);
+        pos_ += n;
+        bit_cnt_ += n;
+        if (pos_ >= CHAR_BIT) {
+            char out[sizeof(uint64_t)];
+            size_t k = 0;
+            while (pos_ >= CHAR_BIT) {
+                out[k++] = acc_ >> (64 - CHAR_BIT);
+                acc_ <<= CHAR_BIT;
+                pos_ -= CHAR_BIT;
+            }
+            // The file buffer already batches the output: going to it
+            // directly skips the sentry that every ostream::write builds.
+            ws_.rdbuf()->sputn(out, k);
         }
     }
 
@@ -336,14 +1101,24 @@ namespace huffman_algo {
         return pos_;
     }
 
+    size_t bit_ref_writer::get_total_bits() const {
+        return bit_cnt_;
+    }
+
     void bit_ref_writer::clear_counter() {
         bit_cnt_ = 0;
     }
 
     void bit_ref_writer::write_char(char c) {
-        for (size_t i = 0; i < CHAR_BIT; ++i) {
-            add_bit((c & (1 << (CHAR_BIT - 1 - i))));
+        add_bits((unsigned char)c, CHAR_BIT);
+    }
+
+    void bit_ref_writer::write_size(size_t n) {
+        while (n >= 0x80) {
+            write_char((char)((n & 0x7f) | 0x80));
+            n >>= 7;
         }
+        write_char((char)n);
     }
 
     std::ostream& operator<<(std::ostream& out, const archive_exception& mexp) {
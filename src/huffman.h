@@ -11,21 +11,42 @@
 #include <exception>
 #include <climits>
 #include <memory>
+#include <array>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 
 namespace huffman_algo {
+    typedef std::array<size_t, 1 << CHAR_BIT> histogram;
+
     class bit_ref_reader {
     public:
-        bit_ref_reader(std::ifstream& it) : rs_(it) {}
+        bit_ref_reader(std::ifstream& it) : rs_(it), chunk_(chunk_len + 8) {}
         bool get_bit();
         void move_iter();
         char read_char();
+        size_t read_size();
+        void refill();
+        uint64_t peek_bits(size_t n) const;
+        void skip_bits(size_t n);
         size_t get_counter() const;
         size_t get_bit_counter() const;
+        size_t get_total_bits() const;
         size_t get_byte_counter() const;
         void clear_counter();
+        static const size_t refill_bits = 56;
     private:
+        void read_chunk();
+        static const size_t chunk_len = 1 << 16;
         std::ifstream& rs_;
-        std::bitset<CHAR_BIT> bs_ = std::bitset<CHAR_BIT>();
+        std::vector<unsigned char> chunk_;
+        size_t chunk_pos_ = 0;
+        size_t chunk_end_ = 0;
+        uint64_t buf_ = 0;
+        size_t buf_len_ = 0;
         size_t bit_cnt_ = 0;
         size_t byte_cnt_ = 0;
         size_t pos_ = 0;
@@ -35,13 +56,17 @@ namespace huffman_algo {
     public:
         bit_ref_writer(std::ofstream& it) : ws_(it) {}
         void add_bit(bool b);
+        void add_bits(uint64_t bits, size_t n);
         size_t get_counter() const;
         size_t get_pos() const;
+        size_t get_total_bits() const;
         void clear_counter();
         void write_char(char c);
+        void write_size(size_t n);
+        static const size_t max_bits = 64 - CHAR_BIT + 1;
     private:
         std::ofstream& ws_;
-        char bs_ = 0;
+        uint64_t acc_ = 0;
         size_t pos_ = 0;
         size_t bit_cnt_ = 0;
     };
@@ -68,15 +93,123 @@ namespace huffman_algo {
     class huff_tree {
     public:
         huff_tree() : tree_root_(new tree_node('\0', 0)) {}
-        explicit huff_tree(std::map<char, int>& freqs);
+        explicit huff_tree(std::map<char, int>& freqs, size_t max_len = 0);
         tree_node* get_root() const;
         void clear();
         std::vector<bool>& get_code(char c);
+        void set_escape(char c);
+        bool has_escape() const;
+        char get_escape() const;
+        void encode_char(bit_ref_writer& brw, char c);
+        size_t get_encoded_size(const histogram& h) const;
+        size_t get_table_size() const;
+        size_t get_min_code_length() const;
+        size_t get_max_code_length() const;
         char deserialize_char(bit_ref_reader& brr);
     private:
         void process_codes(std::vector<bool>& v, tree_node* nd);
+        void limit_code_lengths(std::map<char, int>& freqs, size_t max_len);
+        void put_code(bit_ref_writer& brw, char c);
+        static size_t code_length(const tree_node* nd, bool longest);
         std::unique_ptr<tree_node> tree_root_;
         std::map<char, std::vector<bool>> codes_;
+        std::array<uint64_t, 1 << CHAR_BIT> code_bits_ =
+            std::array<uint64_t, 1 << CHAR_BIT>();
+        std::array<size_t, 1 << CHAR_BIT> code_lens_ =
+            std::array<size_t, 1 << CHAR_BIT>();
+        bool has_escape_ = false;
+        char escape_ = 0;
+    };
+
+    class block_decoder {
+    public:
+        virtual ~block_decoder() {}
+        virtual void decode(bit_ref_reader& brr, char* out, size_t len) = 0;
+        static std::unique_ptr<block_decoder> create(huff_tree& tree);
+    private:
+        template <size_t TableBits, size_t MaxCodeLen>
+        static std::unique_ptr<block_decoder> create_table(
+            const huff_tree& tree);
+    };
+
+    class tree_decoder : public block_decoder {
+    public:
+        explicit tree_decoder(huff_tree& tree) : tree_(tree) {}
+        void decode(bit_ref_reader& brr, char* out, size_t len) override;
+    private:
+        huff_tree& tree_;
+    };
+
+    template <size_t TableBits, size_t MaxCodeLen, size_t MaxSymbols>
+    class table_decoder : public block_decoder {
+    public:
+        explicit table_decoder(const huff_tree& tree);
+        void decode(bit_ref_reader& brr, char* out, size_t len) override;
+    private:
+        struct table_entry {
+            char letters[MaxSymbols];
+            uint8_t count;
+            uint8_t bits;
+            uint8_t first_bits;
+            bool escape;
+            const tree_node* node;
+        };
+        void fill_entries(const tree_node* nd, size_t code, size_t depth);
+        const table_entry& lookup(bit_ref_reader& brr) const;
+        template <size_t K>
+        void decode_lookups(
+            bit_ref_reader& brr,
+            char* out,
+            size_t& i,
+            std::integral_constant<size_t, K>) const;
+        void decode_lookups(
+            bit_ref_reader& brr,
+            char* out,
+            size_t& i,
+            std::integral_constant<size_t, 0>) const;
+        void decode_lookup(bit_ref_reader& brr, char* out, size_t& i) const;
+        char decode_long(bit_ref_reader& brr, const table_entry& e) const;
+        char read_escaped(bit_ref_reader& brr) const;
+        static const size_t lookups_per_refill =
+            bit_ref_reader::refill_bits / TableBits;
+        static_assert(
+            MaxCodeLen <= TableBits ||
+            MaxCodeLen - TableBits + (lookups_per_refill - 1) * TableBits <=
+            bit_ref_reader::refill_bits,
+            "a long code must leave enough bits for the rest of the batch");
+        std::vector<table_entry> table_;
+        bool has_escape_;
+        char escape_;
+    };
+
+    class block_splitter {
+    public:
+        explicit block_splitter(bool adaptive, size_t segment_size) :
+            adaptive_(adaptive), segment_size_(segment_size) {}
+        void add_char(char c);
+        void finish();
+        const std::vector<size_t>& get_block_lengths() const;
+        const std::vector<histogram>& get_block_histograms() const;
+        static size_t estimate_cost(const histogram& h);
+        static size_t data_cost(const histogram& h);
+        static bool beats_fresh_table(
+            size_t reuse_size,
+            const histogram& h,
+            size_t scale);
+        static size_t table_cost(size_t symbols);
+        static const size_t max_block_len = 1 << 24;
+    private:
+        void close_segment();
+        void close_block();
+        bool adaptive_;
+        size_t segment_size_;
+        histogram block_ = histogram();
+        histogram segment_ = histogram();
+        size_t block_len_ = 0;
+        size_t segment_len_ = 0;
+        size_t block_cost_ = 0;
+        std::vector<size_t> lengths_;
+        std::vector<histogram> hists_;
     };
 
     class huffman_archiver {
@@ -90,16 +223,40 @@ namespace huffman_algo {
         ~huffman_archiver();
         void archive();
         void unarchive();
+        void set_adaptive_blocks(bool adaptive);
+        void set_level(int level);
+        int get_level() const;
         size_t get_source_data_size() const;
         size_t get_received_data_size() const;
         size_t get_extra_data_size() const;
+        static const int min_level = 1;
+        static const int max_level = 9;
+        static const int default_level = 6;
     private:
+        struct level_params {
+            size_t sample_stride;
+            size_t segment_len;
+            size_t max_code_len;
+        };
+        size_t archive_sampled(bit_ref_writer& brw, const level_params& lp);
+        size_t archive_counted(bit_ref_writer& brw, const level_params& lp);
+        size_t write_block(
+            bit_ref_writer& brw,
+            std::unique_ptr<huff_tree>& tree,
+            const histogram& hist,
+            const char* data,
+            size_t len,
+            const level_params& lp);
         void close_streams();
+        static const level_params levels_[max_level];
+        static const size_t sample_run = 64;
         std::ifstream inp;
         std::ofstream outp;
         size_t source_len_ = 0;
         size_t extra_len_ = 0;
         size_t received_len_ = 0;
+        bool adaptive_blocks_ = true;
+        int level_ = default_level;
     };
 
     class archive_exception : public std::logic_error {
@@ -13,11 +13,31 @@ bool check_arguments(const char* arg1, const char* arg2) {
     return valid_arg1 && valid_arg2;
 }
 
+bool is_level(const char* arg) {
+    return strlen(arg) == 2 && arg[0] == '-' && arg[1] >= '1' && arg[1] <= '9';
+}
+
 int main(int argc, char *argv[]) {
+    int level = huffman_algo::huffman_archiver::default_level;
+    bool has_level = (argc == 7);
+    if (argc == 7 && is_level(argv[argc - 1])) {
+        level = argv[argc - 1][1] - '0';
+        --argc;
+    } else if (argc == 7 && is_level(argv[2])) {
+        level = argv[2][1] - '0';
+        for (int i = 2; i < argc - 1; ++i)
+            argv[i] = argv[i + 1];
+        --argc;
+    }
     if (argc != 6) {
         std::cerr << "Error: invalid arguments.\n";
         return -1;
     }
+    // The level of an archive is read from its header.
+    if (has_level && strcmp(argv[1], "-c") != 0) {
+        std::cerr << "Error: compression level is only valid with -c.\n";
+        return -1;
+    }
     try {
         std::string in_fn = "";
         std::string out_fn = "";
@@ -34,6 +54,7 @@ int main(int argc, char *argv[]) {
         }
         huffman_algo::huffman_archiver arch(in_fn, out_fn);
         if (strcmp(argv[1], "-c") == 0) {
+            arch.set_level(level);
             arch.archive();
         } else if (strcmp(argv[1], "-u") == 0) {
             arch.unarchive();
@@ -157,4 +157,239 @@ bool test_tree_node_deserialize() {
     return 1;
 }
 
-}
\ No newline at end of file
+size_t archive_file(const char* in_fn, const char* out_fn, bool adaptive) {
+    huffman_archiver arch(in_fn, out_fn);
+    arch.set_adaptive_blocks(adaptive);
+    arch.archive();
+    return arch.get_received_data_size() + arch.get_extra_data_size();
+}
+
+bool test_adaptive_blocks() {
+    std::srand(std::time(nullptr));
+    const size_t part_len = 1 << 16;
+    std::string text = "the quick brown fox jumps over the lazy dog\n";
+    std::string data;
+    for (size_t i = 0; i < part_len; ++i)
+        data.push_back(text[i % text.size()]);
+    for (size_t i = 0; i < part_len; ++i)
+        data.push_back(std::rand() % 256);
+    for (size_t i = 0; i < part_len; ++i)
+        data.push_back(text[(i * 7) % text.size()]);
+    std::ofstream outp("test_inp", std::ios::out);
+    outp.write(data.data(), data.size());
+    outp.close();
+
+    size_t fixed_size = archive_file("test_inp", "test_bin", false);
+    size_t adaptive_size = archive_file("test_inp", "test_bin", true);
+    if (adaptive_size >= fixed_size) {
+        std::cerr << "Adaptive blocks don't improve compression.\n";
+        return 0;
+    }
+
+    return test_unarch("test_bin", data);
+}
+
+bool test_unarch(const char* in_fn, const std::string& data) {
+    huffman_archiver* unarch = new huffman_archiver(in_fn, "test_final");
+    unarch->unarchive();
+    size_t unarch_rec = unarch->get_received_data_size();
+    delete unarch;
+    if (unarch_rec != data.size()) {
+        std::cerr << "Sizes don't match.\n";
+        return 0;
+    }
+    std::ifstream inp("test_final", std::ios::in);
+    inp >> std::noskipws;
+    std::string result(data.size(), '\0');
+    inp.read(&result[0], result.size());
+    if (result != data) {
+        std::cerr << "Input and output files don't match.\n";
+        return 0;
+    }
+    return 1;
+}
+
+bool test_skewed_data() {
+    std::srand(std::time(nullptr));
+    // Geometric distributions over k letters reach every table width; the
+    // deepest letters are too rare to make codes longer than 32 bits.
+    for (size_t k : {2, 3, 5, 9, 11, 13, 20, 40}) {
+        std::string data;
+        for (size_t i = 0; i < 100000; ++i) {
+            size_t s = 0;
+            while (s + 1 < k && std::rand() % 2)
+                ++s;
+            data.push_back('a' + s);
+        }
+        std::ofstream outp("test_inp", std::ios::out);
+        outp.write(data.data(), data.size());
+        outp.close();
+        archive_file("test_inp", "test_bin", true);
+        if (!test_unarch("test_bin", data))
+            return 0;
+    }
+    return 1;
+}
+
+bool test_deep_codes() {
+    std::map<char, int> freqs;
+    int a = 1;
+    int b = 1;
+    for (char c = 'A'; c < 'A' + 40; ++c) {
+        freqs[c] = a;
+        int t = a + b;
+        a = b;
+        b = t;
+    }
+    huff_tree tree(freqs);
+    if (tree.get_max_code_length() <= 32)
+        return 0;
+    // '!' has no code and, like 'A' itself, is sent raw after 'A'.
+    tree.set_escape('A');
+    std::string data;
+    for (auto &it : freqs)
+        data.push_back(it.first);
+    data += "!A!";
+
+    std::ofstream outp("test_inp", std::ios::out);
+    bit_ref_writer brw(outp);
+    for (auto c : data)
+        tree.encode_char(brw, c);
+    while (brw.get_pos() > 0)
+        brw.add_bit(1);
+    outp.close();
+
+    std::ifstream inp("test_inp", std::ios::in);
+    bit_ref_reader brr(inp);
+    std::unique_ptr<block_decoder> decoder = block_decoder::create(tree);
+    std::string result(data.size(), '\0');
+    decoder->decode(brr, &result[0], result.size());
+    return result == data;
+}
+
+bool test_levels() {
+    std::srand(std::time(nullptr));
+    std::string text = "the quick brown fox jumps over the lazy dog\n";
+    std::string data;
+    for (size_t i = 0; i < 200000; ++i) {
+        // Rare letters at odd positions are missed by the sampled levels.
+        if (i % 997 == 1)
+            data.push_back(std::rand() % 256);
+        else if (i < 100000)
+            data.push_back(text[i % text.size()]);
+        else
+            data.push_back(text[std::rand() % 8]);
+    }
+    std::ofstream outp("test_inp", std::ios::out);
+    outp.write(data.data(), data.size());
+    outp.close();
+
+    for (int level = huffman_archiver::min_level;
+         level <= huffman_archiver::max_level; ++level) {
+        huffman_archiver* arch = new huffman_archiver("test_inp", "test_bin");
+        arch->set_level(level);
+        arch->archive();
+        size_t arch_src = arch->get_source_data_size();
+        size_t arch_rec = arch->get_received_data_size();
+        size_t arch_extra = arch->get_extra_data_size();
+        delete arch;
+        huffman_archiver* unarch =
+            new huffman_archiver("test_bin", "test_final");
+        unarch->unarchive();
+        int unarch_level = unarch->get_level();
+        size_t unarch_src = unarch->get_source_data_size();
+        size_t unarch_extra = unarch->get_extra_data_size();
+        delete unarch;
+        if (unarch_level != level ||
+            arch_rec != unarch_src ||
+            arch_extra != unarch_extra) {
+            std::cerr << "Level " << level << ": headers don't match.\n";
+            return 0;
+        }
+        if (arch_src != data.size() || !test_unarch("test_bin", data))
+            return 0;
+    }
+    return 1;
+}
+
+bool test_level_ratio() {
+    std::srand(std::time(nullptr));
+    // Codes of this data grow past the length limit of the top levels.
+    std::string data;
+    for (size_t i = 0; i < 200000; ++i) {
+        size_t s = 0;
+        while (s + 1 < 30 && std::rand() % 2)
+            ++s;
+        data.push_back('a' + s);
+    }
+    std::ofstream outp("test_inp", std::ios::out);
+    outp.write(data.data(), data.size());
+    outp.close();
+
+    size_t sizes[huffman_archiver::max_level + 1];
+    for (int level = huffman_archiver::min_level;
+         level <= huffman_archiver::max_level; ++level) {
+        huffman_archiver* arch = new huffman_archiver("test_inp", "test_bin");
+        arch->set_level(level);
+        arch->archive();
+        sizes[level] =
+            arch->get_received_data_size() + arch->get_extra_data_size();
+        delete arch;
+    }
+    for (int level = 5; level <= huffman_archiver::max_level; ++level) {
+        if (sizes[level] > sizes[4]) {
+            std::cerr << "Level " << level << " compresses worse than 4.\n";
+            return 0;
+        }
+    }
+    return test_unarch("test_bin", data);
+}
+
+bool test_length_limited_tree() {
+    std::map<char, int> freqs;
+    int a = 1;
+    int b = 1;
+    for (char c = 'a'; c < 'a' + 25; ++c) {
+        freqs[c] = a;
+        int t = a + b;
+        a = b;
+        b = t;
+    }
+    huff_tree unlimited(freqs);
+    huff_tree limited(freqs, 12);
+    if (unlimited.get_max_code_length() <= 12 ||
+        limited.get_max_code_length() > 12) {
+        return 0;
+    }
+    // Every letter keeps a code and the codes stay a prefix code.
+    for (auto &it : freqs) {
+        if (limited.get_code(it.first).empty())
+            return 0;
+    }
+    std::ofstream outp("test_inp", std::ios::out);
+    bit_ref_writer brw(outp);
+    for (auto &it : freqs)
+        limited.encode_char(brw, it.first);
+    while (brw.get_pos() > 0)
+        brw.add_bit(1);
+    outp.close();
+    std::ifstream inp("test_inp", std::ios::in);
+    bit_ref_reader brr(inp);
+    for (auto &it : freqs) {
+        if (limited.deserialize_char(brr) != it.first)
+            return 0;
+    }
+    return 1;
+}
+
+bool test_invalid_level() {
+    huffman_archiver arch("test_inp", "test_bin");
+    try {
+        arch.set_level(huffman_archiver::max_level + 1);
+    } catch (archive_exception& e) {
+        return 1;
+    }
+    return 0;
+}
+
+}
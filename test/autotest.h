@@ -18,4 +18,13 @@ namespace huff_algo_tests {
     bool test_tree_node_serialize();
     bool test_node_eq(tree_node* l, tree_node* r);
     bool test_tree_node_deserialize();
+    size_t archive_file(const char* in_fn, const char* out_fn, bool adaptive);
+    bool test_adaptive_blocks();
+    bool test_unarch(const char* in_fn, const std::string& data);
+    bool test_skewed_data();
+    bool test_deep_codes();
+    bool test_levels();
+    bool test_level_ratio();
+    bool test_length_limited_tree();
+    bool test_invalid_level();
 }
\ No newline at end of file
@@ -19,4 +19,32 @@ TEST_CASE("Test tree_node serializing") {
 
 TEST_CASE("Test tree_node deserializing") {
     CHECK(test_tree_node_deserialize() == true);
+}
+
+TEST_CASE("Test adaptive block splitting") {
+    CHECK(test_adaptive_blocks() == true);
+}
+
+TEST_CASE("Test skewed data decoding") {
+    CHECK(test_skewed_data() == true);
+}
+
+TEST_CASE("Test codes longer than 32 bits") {
+    CHECK(test_deep_codes() == true);
+}
+
+TEST_CASE("Test compression levels") {
+    CHECK(test_levels() == true);
+}
+
+TEST_CASE("Test higher levels don't lose ratio") {
+    CHECK(test_level_ratio() == true);
+}
+
+TEST_CASE("Test length-limited tree") {
+    CHECK(test_length_limited_tree() == true);
+}
+
+TEST_CASE("Test invalid compression level") {
+    CHECK(test_invalid_level() == true);
 }
\ No newline at end of file